@@ -28,21 +28,36 @@ POSSIBILITY OF SUCH DAMAGE.
 
 ***************************************************************************/
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* sched_setaffinity */
+#endif
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <math.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <termios.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #ifdef __FreeBSD__
+#include <sys/cpuset.h>
 #include <sys/cpuctl.h>
+#include <sys/sysctl.h>
 #include <x86/specialreg.h>
 #else
+#include <sched.h>
 /* cribbed from FreeBSD specialreg.h */
 #define CPUID_MODEL 	 	0x000000f0
 #define CPUID_FAMILY 	 	0x00000f00
@@ -69,6 +84,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #define INTEL_ENERGY_DRAM_MSR		0x619
 #define INTEL_ENERGY_PWR_UNIT_MSR	0x606
 
+#define MPERF_MSR	0xE7
+#define APERF_MSR	0xE8
+
 static u_int	cpu_procinfo;
 static u_int	cpu_id;
 static u_int	cpu_high;
@@ -101,6 +119,310 @@ enum processor_type {
 };
 static enum processor_type cpu;
 
+/*
+ * Per-cgroup (v2) energy budgets.  Package power is attributed to
+ * each cgroup by its share of the machine's CPU time, and cpu.max is
+ * nudged up or down to keep the attributed power under budget.
+ */
+#define BUDGET_STEP		0.10	/* max quota change per interval */
+#define BUDGET_HYST		0.90	/* relax quota below this much of budget */
+#define BUDGET_MIN_QUOTA	1000.0	/* usec, kernel minimum */
+#define BUDGET_PERIOD		100000	/* usec, cgroup default */
+
+struct budget {
+	char *path;
+	double watts;
+	uint64_t usage;
+	double quota;
+	double orig_quota;	/* never relaxed above this */
+	char orig[64];		/* cpu.max as found, restored on exit */
+	u_int period;
+	bool gone;		/* cgroup removed, no longer managed */
+};
+
+static struct budget *budgets;
+static int nbudgets;
+
+/*
+ * "pmon run" repeats a command until the energy counters' resolution
+ * is small compared to the total, then reports energy per iteration.
+ *
+ * The command gets a pipe in PMON_FD.  A benchmark that writes one
+ * byte to it at the start of its timed loop and one at the end is
+ * measured between those writes; otherwise the whole process is
+ * measured, including exec, startup and teardown.  The snapshots are
+ * taken when pmon wakes up on each byte, so both edges lag by about
+ * the same wakeup latency and the window keeps its length.
+ */
+#define RUN_MIN_TIME	1.0	/* seconds, >> the ~1ms counter update */
+#define RUN_PRECISION	0.001	/* counter resolution / total energy */
+
+static u_int	run_iters = 1;
+static int	run_core = -1;
+
+struct sample {
+	double t;
+	double pkg;
+	double core;
+	bool edges;	/* bracketed by PMON_FD writes */
+};
+
+/*
+ * "pmon tune" runs a command over thread counts, placements and
+ * frequency caps, dropping points that are clearly dominated after
+ * their first run, and reports the energy/time Pareto front.
+ */
+#define TUNE_RUNS	3	/* runs per surviving point */
+#define TUNE_MARGIN	0.10	/* prune when this much worse in both */
+#define TUNE_MAX	64	/* max entries in -t / -f lists */
+
+struct tune_point {
+	u_int threads;
+	bool spread;
+	u_int mhz;
+	u_int runs;
+	double t;
+	double pkg;
+	bool pruned;
+};
+
+static char	*tune_threads;
+static char	*tune_freqs;
+
+/*
+ * cpu orders for the compact and spread placements, and the L3 of
+ * every cpu, built from the Linux sysfs topology; NULL when it cannot
+ * be determined.
+ */
+static const char *sysfs_cpu = "/sys/devices/system/cpu";
+static u_int	*topo_compact;
+static u_int	*topo_spread;
+static u_int	*topo_l3;
+
+struct topo {
+	u_int cpu;
+	u_int l3;	/* L3 (CCD) id */
+	u_int core;	/* first sibling */
+	u_int smt;	/* index among siblings */
+	u_int rank;	/* core index within the L3 */
+};
+
+/*
+ * Frequency caps.  The cap of every cpu is saved before the first
+ * change and put back by freq_restore(), which also runs at exit so
+ * an error or signal during a tune does not leave cpus capped.
+ */
+#ifdef __FreeBSD__
+static int	freq_orig;	/* MHz */
+#else
+static u_int	*freq_orig;	/* kHz, per cpu */
+#endif
+static bool	freq_capped;
+
+/*
+ * User-defined core groups and derived metrics (-c file), e.g.
+ *
+ *	group irq_cores = 0-7
+ *	group nginx = 8-63
+ *	tdp = 280
+ *	uncore = pkg - sum(cores)
+ *	nginx_share = nginx / pkg
+ *
+ * The file is compiled once at startup into a flat stack program
+ * which is run over the per-core sample array every interval.
+ */
+#define METRIC_STACK	32
+
+enum mop_type {
+	MOP_CONST,
+	MOP_PKG,
+	MOP_DRAM,
+	MOP_GROUP,
+	MOP_METRIC,
+	MOP_ADD,
+	MOP_SUB,
+	MOP_MUL,
+	MOP_DIV,
+	MOP_NEG
+};
+
+struct mop {
+	enum mop_type type;
+	u_int arg;
+	double val;
+};
+
+struct mgroup {
+	char *name;
+	u_int first;
+	u_int ncores;
+	double watts;
+};
+
+struct metric {
+	char *name;
+	u_int first;
+	u_int nops;
+	double value;
+};
+
+static struct mgroup	*groups;
+static u_int		ngroups;
+static u_int		*group_cores;
+static u_int		ngroup_cores;
+static struct metric	*metrics;
+static u_int		nmetrics;
+static struct mop	*mops;
+static u_int		nmops;
+
+/* most recent interval, in watts */
+static double	*core_watts;
+static double	pkg_watts;
+static double	dram_watts;
+
+/*
+ * Application latency histograms (-H file), typically in /dev/shm.
+ * The application owns the file and keeps cumulative per-bucket
+ * counts; pmon maps it read-only and takes deltas every interval.
+ * Intervals are binned by effective frequency (APERF/MPERF scaled by
+ * the TSC rate) to build an energy vs. tail latency curve, printed
+ * on exit along with the cheapest bin meeting the -L SLO.
+ *
+ * Frequency alone cannot tell load levels or power limits apart, so
+ * the operator can also name the current operating point in a -K
+ * key file (its first line, e.g. "load=40%" or "pl=180W"), which is
+ * re-read every interval.  Bins are then per key and frequency, and
+ * an interval during which the key changed is not binned.
+ */
+#define HIST_MAGIC	0x47484d50	/* "PMHG" */
+#define HIST_MAX_BUCKETS	4096
+#define HIST_FREQ_BIN	100		/* MHz */
+#define HIST_NBINS	100		/* frequency bins per key */
+#define HIST_PCT	0.99
+#define HIST_KEY_LEN	32
+
+struct hist_bucket {
+	uint64_t bound;		/* upper bound, usec */
+	uint64_t count;		/* cumulative */
+};
+
+struct hist_shm {
+	uint32_t magic;
+	uint32_t nbuckets;
+	struct hist_bucket b[];
+};
+
+struct hist_bin {
+	char key[HIST_KEY_LEN];
+	u_int mhz;
+	u_int intervals;
+	double watts;
+	uint64_t *counts;
+};
+
+static volatile struct hist_shm *hist;
+static u_int		hist_nbuckets;
+static uint64_t		*hist_last;
+static uint64_t		*hist_delta;
+static struct hist_bin	*hist_bins;
+static u_int		nhist_bins;
+static double		hist_slo;
+static double		hist_mhz;
+static const char	*hist_keyfile;
+static char		hist_key[HIST_KEY_LEN];
+
+/*
+ * DRAM energy attribution (-M resctrl_root).  Each resctrl group's
+ * MBM byte counters (summed over L3 domains) give its share of the
+ * DRAM power.  Control groups are disjoint and make up the total;
+ * their mon_groups are a breakdown of the parent.  The tree is
+ * rescanned every interval as tenants come and go: the scan takes
+ * each group's delta, and groups that have disappeared are dropped.
+ */
+struct mbm_group {
+	char *name;
+	char *path;
+	bool ctrl;
+	bool seen;
+	uint64_t last;
+	uint64_t delta;
+};
+
+static const char	*mbm_root;
+static struct mbm_group	*mbm;
+static u_int		nmbm;
+
+/*
+ * "pmon spectrum" samples package power, each L3 (CCD) and any -c core
+ * groups at -S Hz, or reads a -w recording or a saved pmon log (one
+ * sample per line, taken at the rate -S must give), and runs a
+ * Hann-windowed FFT over each half-overlapping window to report the
+ * strongest periodic components and their amplitude in watts.
+ */
+#define SPEC_WINDOW	1024	/* samples, power of 2 */
+#define SPEC_PEAKS	3
+#define SPEC_MIN_WATTS	0.05	/* ignore peaks below this */
+#define SPEC_RATE	500.0	/* Hz, live default */
+
+static double	spec_rate;	/* 0 until -S or a recording sets it */
+
+static struct {
+	double *re;
+	double *im;
+	double *win;
+	double *cos;		/* twiddles, stage of size 2h at [h, 2h) */
+	double *sin;
+	u_int *rev;
+	double gain;
+} fft;
+
+/*
+ * Recordings (-w file).  A header followed by fixed-size records, so
+ * record i is at a known offset and the file is its own time index:
+ * the viewer binary searches the timestamps of the mmapped records.
+ * SIGUSR1 sets the marker flag on the next record.
+ */
+#define REC_MAGIC	0x43524d50	/* "PMRC" */
+#define REC_VERSION	1
+
+struct rec_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ncores;
+	uint32_t recsize;
+	double interval;	/* seconds */
+	double start;		/* wall clock, seconds since the epoch */
+};
+
+struct rec {
+	double t;		/* seconds since start */
+	float pkg;
+	float dram;
+	uint32_t marker;
+	float core[];
+};
+
+static FILE		*rec_file;
+static struct rec	*rec_buf;
+static struct rec_hdr	rec_hdr;
+static double		rec_t0;
+static volatile sig_atomic_t rec_marker;
+
+/*
+ * "pmon heatmap" renders a recording as a cores x time PPM image.
+ * Records are streamed once; each column keeps the per-core max and
+ * min of the records it covers, drawn as the upper and lower pixel
+ * of that core's row, so short spikes and dips survive downsampling.
+ */
+#define HEAT_WIDTH	1920
+#define HEAT_CHUNK	4096	/* records per read */
+
+static u_int	heat_width = HEAT_WIDTH;
+static double	heat_max;
+static bool	heat_log;
+
+static volatile sig_atomic_t done;
+
 static __inline void
 do_cpuid(u_int ax, u_int *p)
 {
@@ -109,6 +431,15 @@ do_cpuid(u_int ax, u_int *p)
 	    :  "0" (ax));
 }
 
+static __inline uint64_t
+read_tsc(void)
+{
+	uint32_t lo, hi;
+
+	__asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return (((uint64_t)hi << 32) | lo);
+}
+
 static __inline void
 cpuid_count(u_int ax, u_int cx, u_int *p)
 {
@@ -117,6 +448,15 @@ cpuid_count(u_int ax, u_int cx, u_int *p)
             :  "0" (ax), "c" (cx));
 }
 
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1000000000.0);
+}
+
 #ifdef __FreeBSD__
 static uint64_t
 read_msr(struct softc *sc, int reg)
@@ -159,7 +499,8 @@ open_msrs(void)
 			i = 0; /* for pkg & Intel dram power */
 		} else {
 			i = core;
-			if (cpu == INTEL && core != 0)
+			/* Intel: per-core MSRs only for APERF/MPERF */
+			if (cpu == INTEL && core != 0 && hist == NULL)
 				continue;
 		}
 		sc = &softc[core];
@@ -168,7 +509,7 @@ open_msrs(void)
 #else
 		sprintf(path, "/dev/cpu/%d/msr", i * share_count);
 #endif
-		sc->fd = open(path, O_RDONLY);
+		sc->fd = open(path, O_RDONLY | O_CLOEXEC);
 		if (sc->fd == -1) {
 			perror("open");
 #ifdef __FreeBSD__
@@ -280,8 +621,9 @@ identify_cpu(void)
 	cpuid_count(0x8000001e, 0, regs);
 	share_count = ((regs[1] >> 8) & 0xff) + 1;
 	cpu_count = sysconf(_SC_NPROCESSORS_CONF) / share_count;
-	softc = calloc(cpu_count + 1, sizeof(*softc));
-	if (softc == NULL) {
+	softc = calloc(cpu_count + 2, sizeof(*softc));
+	core_watts = calloc(cpu_count, sizeof(*core_watts));
+	if (softc == NULL || core_watts == NULL) {
 		perror("malloc");
 		exit(1);
 	}
@@ -320,36 +662,544 @@ intel_add_power(uint64_t input, double units)
 	return (input * units);
 }
 
+static double
+joules_per_count(u_int reg)
+{
+	if (cpu == AMD)
+		return (amd_add_power(1) / 1000000.0);
+	return (reg == dram_msr ? dram_units : energy_units);
+}
+
+/* the energy counters are 32 bits wide on both vendors */
+static double
+read_joules(struct softc *sc, u_int reg)
+{
+	return ((uint32_t)read_msr(sc, reg) * joules_per_count(reg));
+}
+
+static double
+joules_delta(double then, double cur, u_int reg)
+{
+	if (cur < then)
+		cur += 4294967296.0 * joules_per_count(reg);
+	return (cur - then);
+}
+
+static void
+metrics_eval(void)
+{
+	double stack[METRIC_STACK];
+	struct mop *op, *end;
+	double sum;
+	u_int i, j, sp;
+
+	for (i = 0; i < ngroups; i++) {
+		sum = 0.0;
+		for (j = 0; j < groups[i].ncores; j++)
+			sum += core_watts[group_cores[groups[i].first + j]];
+		groups[i].watts = sum;
+		printf("\t%s: %4.2lf", groups[i].name, sum);
+	}
+	for (i = 0; i < nmetrics; i++) {
+		sp = 0;
+		op = &mops[metrics[i].first];
+		end = op + metrics[i].nops;
+		for (; op < end; op++) {
+			switch (op->type) {
+			case MOP_CONST:
+				stack[sp++] = op->val;
+				break;
+			case MOP_PKG:
+				stack[sp++] = pkg_watts;
+				break;
+			case MOP_DRAM:
+				stack[sp++] = dram_watts;
+				break;
+			case MOP_GROUP:
+				stack[sp++] = groups[op->arg].watts;
+				break;
+			case MOP_METRIC:
+				stack[sp++] = metrics[op->arg].value;
+				break;
+			case MOP_ADD:
+				sp--;
+				stack[sp - 1] += stack[sp];
+				break;
+			case MOP_SUB:
+				sp--;
+				stack[sp - 1] -= stack[sp];
+				break;
+			case MOP_MUL:
+				sp--;
+				stack[sp - 1] *= stack[sp];
+				break;
+			case MOP_DIV:
+				sp--;
+				stack[sp - 1] /= stack[sp];
+				break;
+			case MOP_NEG:
+				stack[sp - 1] = -stack[sp - 1];
+				break;
+			}
+		}
+		metrics[i].value = stack[0];
+		printf("\t%s: %4.2lf", metrics[i].name, stack[0]);
+	}
+}
+
+static void
+hist_open(const char *path)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) != 0) {
+		perror(path);
+		exit(1);
+	}
+	if ((size_t)st.st_size < sizeof(struct hist_shm)) {
+		fprintf(stderr, "%s: not a pmon histogram\n", path);
+		exit(1);
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+	hist = p;
+	hist_nbuckets = hist->nbuckets;
+	if (hist->magic != HIST_MAGIC || hist_nbuckets == 0 ||
+	    hist_nbuckets > HIST_MAX_BUCKETS ||
+	    (size_t)st.st_size < sizeof(struct hist_shm) +
+	    hist_nbuckets * sizeof(struct hist_bucket)) {
+		fprintf(stderr, "%s: not a pmon histogram\n", path);
+		exit(1);
+	}
+	hist_last = calloc(hist_nbuckets, sizeof(*hist_last));
+	hist_delta = calloc(hist_nbuckets, sizeof(*hist_delta));
+	if (hist_last == NULL || hist_delta == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+}
+
+/*
+ * Re-read the -K key file; returns true if the key changed.  An
+ * unreadable or empty file keeps the previous key, so a non-atomic
+ * rewrite does not create a spurious bin.
+ */
+static bool
+hist_key_read(void)
+{
+	char line[HIST_KEY_LEN];
+	FILE *f;
+
+	if (hist_keyfile == NULL)
+		return (false);
+	f = fopen(hist_keyfile, "r");
+	if (f == NULL)
+		return (false);
+	if (fgets(line, sizeof(line), f) == NULL)
+		line[0] = '\0';
+	fclose(f);
+	line[strcspn(line, "\n")] = '\0';
+	if (line[0] == '\0' || strcmp(line, hist_key) == 0)
+		return (false);
+	snprintf(hist_key, sizeof(hist_key), "%s", line);
+	return (true);
+}
+
+static struct hist_bin *
+hist_bin_find(const char *key, u_int mhz)
+{
+	struct hist_bin *bin;
+	u_int i;
+
+	for (i = 0; i < nhist_bins; i++) {
+		bin = &hist_bins[i];
+		if (bin->mhz == mhz && strcmp(bin->key, key) == 0)
+			return (bin);
+	}
+	hist_bins = realloc(hist_bins, (nhist_bins + 1) * sizeof(*hist_bins));
+	if (hist_bins == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	bin = &hist_bins[nhist_bins++];
+	snprintf(bin->key, sizeof(bin->key), "%s", key);
+	bin->mhz = mhz;
+	bin->intervals = 0;
+	bin->watts = 0.0;
+	bin->counts = calloc(hist_nbuckets, sizeof(uint64_t));
+	if (bin->counts == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	return (bin);
+}
+
+static int
+hist_bin_cmp(const void *a, const void *b)
+{
+	const struct hist_bin *x = a, *y = b;
+	int c;
+
+	if ((c = strcmp(x->key, y->key)) != 0)
+		return (c);
+	return (x->mhz < y->mhz ? -1 : x->mhz > y->mhz);
+}
+
+/* bound of the bucket holding the given percentile, or -1 if empty */
+static double
+hist_pct(const uint64_t *counts, double pct)
+{
+	uint64_t seen, total;
+	u_int i;
+
+	total = 0;
+	for (i = 0; i < hist_nbuckets; i++)
+		total += counts[i];
+	if (total == 0)
+		return (-1.0);
+	seen = 0;
+	for (i = 0; i < hist_nbuckets; i++) {
+		seen += counts[i];
+		if (seen >= pct * total)
+			break;
+	}
+	return ((double)hist->b[MIN(i, hist_nbuckets - 1)].bound);
+}
+
+/*
+ * Effective MHz across all cores since the last call.  MPERF only
+ * counts while a core is active, so summing before dividing weights
+ * each core by its busy time and the result follows the cores doing
+ * the work.
+ */
+static double
+eff_mhz(void)
+{
+	static uint64_t last_tsc;
+	static double last_t;
+	static uint64_t *last_aperf, *last_mperf;
+	uint64_t aperf, mperf, tsc;
+	double da, dm, mhz, t;
+	u_int core;
+
+	if (last_aperf == NULL) {
+		last_aperf = calloc(cpu_count, sizeof(*last_aperf));
+		last_mperf = calloc(cpu_count, sizeof(*last_mperf));
+		if (last_aperf == NULL || last_mperf == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+	da = dm = 0.0;
+	for (core = 0; core < cpu_count; core++) {
+		aperf = read_msr(&softc[core], APERF_MSR);
+		mperf = read_msr(&softc[core], MPERF_MSR);
+		da += aperf - last_aperf[core];
+		dm += mperf - last_mperf[core];
+		last_aperf[core] = aperf;
+		last_mperf[core] = mperf;
+	}
+	tsc = read_tsc();
+	t = now();
+	mhz = 0.0;
+	if (last_t != 0.0 && dm > 0.0)
+		mhz = (tsc - last_tsc) / (t - last_t) * (da / dm) / 1000000.0;
+	last_tsc = tsc;
+	last_t = t;
+	return (mhz);
+}
+
+static void
+hist_update(bool first)
+{
+	struct hist_bin *bin;
+	uint64_t count;
+	bool changed;
+	u_int i;
+
+	for (i = 0; i < hist_nbuckets; i++) {
+		count = hist->b[i].count;
+		/* the application restarted or reset its counts */
+		hist_delta[i] = count >= hist_last[i] ?
+		    count - hist_last[i] : count;
+		hist_last[i] = count;
+	}
+	hist_mhz = eff_mhz();
+	changed = hist_key_read();
+	if (first || changed)
+		return;
+	bin = hist_bin_find(hist_key, MIN((u_int)(hist_mhz / HIST_FREQ_BIN),
+	    HIST_NBINS - 1) * HIST_FREQ_BIN);
+	bin->intervals++;
+	bin->watts += pkg_watts;
+	for (i = 0; i < hist_nbuckets; i++)
+		bin->counts[i] += hist_delta[i];
+}
+
+static void
+hist_report(void)
+{
+	struct hist_bin *bin;
+	double best, lat;
+	u_int i, j, pick, w;
+
+	qsort(hist_bins, nhist_bins, sizeof(*hist_bins), hist_bin_cmp);
+	w = hist_keyfile != NULL ? HIST_KEY_LEN : 0;
+	printf("\n%-*s     MHz  intervals    pkg(W)   p%.0lf(us)\n", w,
+	    hist_keyfile != NULL ? "key" : "", HIST_PCT * 100);
+	for (i = 0; i < nhist_bins; i++) {
+		bin = &hist_bins[i];
+		printf("%-*s%8u  %9u  %8.2lf  %8.0lf\n", w, bin->key,
+		    bin->mhz, bin->intervals, bin->watts / bin->intervals,
+		    hist_pct(bin->counts, HIST_PCT));
+	}
+	if (hist_slo <= 0.0)
+		return;
+	/* a key is a load level or power limit: pick within each one */
+	for (i = 0; i < nhist_bins; i = j) {
+		best = HUGE_VAL;
+		pick = nhist_bins;
+		for (j = i; j < nhist_bins &&
+		    strcmp(hist_bins[j].key, hist_bins[i].key) == 0; j++) {
+			bin = &hist_bins[j];
+			lat = hist_pct(bin->counts, HIST_PCT);
+			if (lat >= 0.0 && lat <= hist_slo &&
+			    bin->watts / bin->intervals < best) {
+				best = bin->watts / bin->intervals;
+				pick = j;
+			}
+		}
+		printf("%s%s", hist_bins[i].key,
+		    hist_bins[i].key[0] != '\0' ? ": " : "");
+		if (pick != nhist_bins)
+			printf("lowest power meeting %.0lf us: %u MHz, "
+			    "%.2lf W\n", hist_slo, hist_bins[pick].mhz, best);
+		else
+			printf("no operating point met %.0lf us\n", hist_slo);
+	}
+	if (nhist_bins == 0)
+		printf("no operating point met %.0lf us\n", hist_slo);
+}
+
+/*
+ * Total MBM bytes for a resctrl group, summed over its L3 domains.
+ * Returns false if the group has gone away.
+ */
+static bool
+mbm_bytes(const char *group, uint64_t *total)
+{
+	char path[MAXPATHLEN];
+	struct dirent *de;
+	uintmax_t bytes;
+	FILE *f;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/mon_data", group);
+	d = opendir(path);
+	if (d == NULL)
+		return (false);
+	*total = 0;
+	while ((de = readdir(d)) != NULL) {
+		if (strncmp(de->d_name, "mon_L3_", 7) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/mon_data/%s/mbm_total_bytes",
+		    group, de->d_name);
+		f = fopen(path, "r");
+		if (f == NULL) {
+			closedir(d);
+			return (false);
+		}
+		/* "Unavailable" while the RMID is being reassigned */
+		if (fscanf(f, "%ju", &bytes) == 1)
+			*total += bytes;
+		fclose(f);
+	}
+	closedir(d);
+	return (true);
+}
+
+static void
+mbm_add(const char *path, const char *name, bool ctrl)
+{
+	struct mbm_group *g;
+	uint64_t bytes;
+	u_int i;
+
+	if (!mbm_bytes(path, &bytes))
+		return;
+	for (i = 0; i < nmbm; i++) {
+		g = &mbm[i];
+		if (strcmp(g->path, path) != 0)
+			continue;
+		g->seen = true;
+		g->delta = bytes > g->last ? bytes - g->last : 0;
+		g->last = bytes;
+		return;
+	}
+	mbm = realloc(mbm, (nmbm + 1) * sizeof(*mbm));
+	if (mbm == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	g = &mbm[nmbm++];
+	g->path = strdup(path);
+	g->name = strdup(name);
+	g->ctrl = ctrl;
+	g->seen = true;
+	g->last = bytes;
+	g->delta = 0;
+}
+
+static void
+mbm_scan_mon(const char *ctrl, const char *prefix)
+{
+	char name[MAXPATHLEN], path[MAXPATHLEN];
+	struct dirent *de;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/mon_groups", ctrl);
+	d = opendir(path);
+	if (d == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/mon_groups/%s", ctrl,
+		    de->d_name);
+		snprintf(name, sizeof(name), "%s%s", prefix, de->d_name);
+		mbm_add(path, name, false);
+	}
+	closedir(d);
+}
+
+/*
+ * Find the current groups and take their deltas.  Groups no longer
+ * present are freed; one recreated later starts over as a new group.
+ */
+static bool
+mbm_scan(void)
+{
+	char name[MAXPATHLEN], path[MAXPATHLEN];
+	struct dirent *de;
+	struct stat st;
+	u_int i, j;
+	DIR *d;
+
+	for (i = 0; i < nmbm; i++)
+		mbm[i].seen = false;
+	d = opendir(mbm_root);
+	if (d != NULL) {
+		mbm_add(mbm_root, "/", true);
+		mbm_scan_mon(mbm_root, "");
+		while ((de = readdir(d)) != NULL) {
+			if (de->d_name[0] == '.' ||
+			    strcmp(de->d_name, "info") == 0 ||
+			    strcmp(de->d_name, "mon_groups") == 0 ||
+			    strcmp(de->d_name, "mon_data") == 0)
+				continue;
+			snprintf(path, sizeof(path), "%s/%s/mon_data",
+			    mbm_root, de->d_name);
+			if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", mbm_root,
+			    de->d_name);
+			mbm_add(path, de->d_name, true);
+			snprintf(name, sizeof(name), "%s/", de->d_name);
+			mbm_scan_mon(path, name);
+		}
+		closedir(d);
+	}
+	for (i = j = 0; i < nmbm; i++) {
+		if (mbm[i].seen) {
+			mbm[j++] = mbm[i];
+		} else {
+			free(mbm[i].name);
+			free(mbm[i].path);
+		}
+	}
+	nmbm = j;
+	return (d != NULL);
+}
+
+static void
+mbm_init(const char *root)
+{
+	if (dram_msr == 0) {
+		fprintf(stderr, "dram power not available on this cpu\n");
+		exit(1);
+	}
+	mbm_root = root;
+	if (!mbm_scan() || nmbm == 0) {
+		fprintf(stderr, "%s: no resctrl monitoring data\n", root);
+		exit(1);
+	}
+}
+
+static void
+mbm_print(void)
+{
+	uint64_t total;
+	u_int i;
+
+	total = 0;
+	for (i = 0; i < nmbm; i++)
+		if (mbm[i].ctrl)
+			total += mbm[i].delta;
+	for (i = 0; i < nmbm; i++)
+		printf("\tdram[%s]: %4.2lf", mbm[i].name,
+		    total == 0 ? 0.0 : dram_watts * mbm[i].delta / total);
+}
+
 static void
+sig_done(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+/*
+ * Read and print the energy counters.  Returns the package power
+ * over the last interval, or -1.0 when there is no prior sample yet.
+ */
+static double
 read_power(void)
 {
 	struct softc *sc;
 	uint64_t data;
-	u_int core, first_core, max;
-	double core_sum, delta, dram, energy, watts;
+	u_int core, first_core, max, reg;
+	double core_sum, delta, dram, energy, pkg, watts;
 	static bool first = true;
 
 	core_sum = dram = 0.0;
+	pkg = -1.0;
 
 	/* just read the pkg power by default */
 	first_core = cpu_count;
 	max = cpu_count + 1;
-	if (verbose && core_msr != 0) {
+	if ((verbose || ngroups != 0 || rec_file != NULL) && core_msr != 0) {
 		/* AMD: read power from each core */
 		first_core = 0;
-	} else if (verbose && dram_msr != 0) {
+	} else if ((verbose || nmetrics != 0 || mbm_root != NULL ||
+	    rec_file != NULL) && dram_msr != 0) {
 		/* Intel: Cant read core power, read Dimm using core N-1 */
 		max++;
 	}
 	for (core = first_core; core < max; core++) {
 		sc = &softc[core];
-		if (core == cpu_count) {
-			data = read_msr(sc, pkg_msr);
-		} else if (core == cpu_count + 1) {
-			data = read_msr(sc, dram_msr);
-		} else {
-			data = read_msr(sc, core_msr);
-		}
+		if (core == cpu_count)
+			reg = pkg_msr;
+		else if (core == cpu_count + 1)
+			reg = dram_msr;
+		else
+			reg = core_msr;
+		data = read_msr(sc, reg) & AMD_ENERGY_MASK;
 		if (cpu == AMD) {
 			energy = amd_add_power(data);
 			/* convert from uJoules to watts */
@@ -358,8 +1208,17 @@ read_power(void)
 			watts = intel_add_power(data,
 			    core == cpu_count ? energy_units : dram_units);
 		}
-		delta = watts - sc->last;
+		delta = joules_delta(sc->last, watts, reg);
 		sc->last = watts;
+		if (core == cpu_count) {
+			pkg_watts = delta * scale;
+			if (!first)
+				pkg = pkg_watts;
+		} else if (core == cpu_count + 1) {
+			dram_watts = delta * scale;
+		} else {
+			core_watts[core] = delta * scale;
+		}
 		if (first && verbose < 2)
 			continue;
 
@@ -370,12 +1229,8 @@ read_power(void)
 				printf("pkg: %4.2lf", delta * scale);
 			if (verbose && amd_energy_units != 0)
 				printf("  core sum=%4.2lf\n", core_sum * scale);
-			if (core == max - 1)
-				printf("\n");
 		} else if (verbose && core == cpu_count + 1) {
 			printf("\tdram: %4.2lf", delta * scale);
-			if (core == max - 1)
-				printf("\n");
 		} else if (verbose && amd_energy_units != 0) {
 			if (core == 0)
 				printf("============================================================================\n");
@@ -389,42 +1244,2083 @@ read_power(void)
 		}
 		core_sum += delta;
 	}
+	if (hist != NULL)
+		hist_update(first);
+	if (mbm_root != NULL)
+		mbm_scan();
+	if (!first || verbose >= 2) {
+		if (ngroups != 0 || nmetrics != 0)
+			metrics_eval();
+		if (nmbm != 0)
+			mbm_print();
+		if (hist != NULL)
+			printf("\tMHz: %.0lf\tp%.0lf: %.0lf", hist_mhz,
+			    HIST_PCT * 100, hist_pct(hist_delta, HIST_PCT));
+		if (hist_keyfile != NULL)
+			printf("\tkey: %s", hist_key);
+		printf("\n");
+	}
 	first = false;
 	fflush(stdout);
+	return (pkg);
+}
+
+static bool
+set_affinity(const u_int *cpus, u_int ncpus)
+{
+#ifdef __FreeBSD__
+	cpuset_t set;
+#else
+	cpu_set_t set;
+#endif
+	u_int i;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < ncpus; i++)
+		CPU_SET(cpus[i], &set);
+#ifdef __FreeBSD__
+	if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+	    sizeof(set), &set) != 0) {
+		perror("cpuset_setaffinity");
+		return (false);
+	}
+#else
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		perror("sched_setaffinity");
+		return (false);
+	}
+#endif
+	return (true);
 }
 
 static void
-usage(char *name)
+run_sample(struct sample *s)
 {
-	fprintf(stderr, "usage: %s [-v] [interval]\n", name);
+	s->t = now();
+	s->pkg = read_joules(&softc[cpu_count], pkg_msr);
+	s->core = 0.0;
+	if (run_core >= 0 && core_msr != 0)
+		s->core = read_joules(&softc[run_core], core_msr);
 }
 
-int
-main(int argc, char **argv)
+/*
+ * Run cmd once on the given cpus (all, if ncpus is 0) and return the
+ * elapsed time and energy in d, between the loop edges the command
+ * marks on PMON_FD if it marks both.  A single run must finish before
+ * the counters wrap twice, which is minutes even at full package
+ * power.
+ */
+static int
+run_once(char **cmd, const u_int *cpus, u_int ncpus, struct sample *d)
 {
-	int timeo = 1;
-	char c;
+	struct sample a, b, start;
+	char buf[16];
+	ssize_t len;
+	pid_t pid;
+	int marks, pfd[2], status;
 
+	fflush(stdout);
+	if (pipe(pfd) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	run_sample(&a);
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		/* _exit: the parent's atexit handlers are not ours to run */
+		close(pfd[0]);
+		snprintf(buf, sizeof(buf), "%d", pfd[1]);
+		setenv("PMON_FD", buf, 1);
+		if (ncpus != 0 && !set_affinity(cpus, ncpus))
+			_exit(127);
+		execvp(cmd[0], cmd);
+		perror(cmd[0]);
+		_exit(127);
+	}
+	close(pfd[1]);
 
-	while ((c = getopt(argc, argv, "v")) != -1) {
-		switch (c) {
-		case 'v':
-			verbose++;
+	/* snapshot at each of the first two bytes, then wait for EOF */
+	marks = 0;
+	for (;;) {
+		len = read(pfd[0], buf, marks < 2 ? 1 : sizeof(buf));
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0)
 			break;
-		default:
-			usage(argv[0]);
+		if (marks == 0)
+			run_sample(&start);
+		else if (marks == 1)
+			run_sample(&b);
+		marks += len;
+	}
+	close(pfd[0]);
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno == EINTR)
+			continue;
+		perror("waitpid");
+		exit(1);
+	}
+	d->edges = marks >= 2;
+	if (d->edges)
+		a = start;
+	else
+		run_sample(&b);
+	d->t = b.t - a.t;
+	d->pkg = joules_delta(a.pkg, b.pkg, pkg_msr);
+	d->core = joules_delta(a.core, b.core, core_msr);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed\n", cmd[0]);
+		return (-1);
+	}
+	return (0);
+}
+
+static void
+print_stat(const char *name, double sum, double sumsq, u_int n,
+    const char *unit)
+{
+	double mean, sd;
+
+	mean = sum / n;
+	sd = n > 1 ? sqrt(MAX(sumsq / n - mean * mean, 0.0)) : 0.0;
+	printf("%-10s %12.6g %s/iter  +- %5.2lf%%\n", name,
+	    mean / run_iters, unit, mean > 0.0 ? 100.0 * sd / mean : 0.0);
+}
+
+static void
+print_bracket(u_int edges, u_int runs)
+{
+	if (edges == runs)
+		printf("measured between PMON_FD loop edges\n");
+	else if (edges == 0)
+		printf("measured whole process, including exec and startup "
+		    "(no PMON_FD loop edges)\n");
+	else
+		printf("warning: only %u of %u runs marked PMON_FD loop "
+		    "edges, the rest include exec and startup\n", edges, runs);
+}
+
+static int
+run_cmd(char **cmd)
+{
+	struct sample d, sum, sumsq;
+	char name[32];
+	double res;
+	u_int edges, n, pin;
+
+	res = joules_per_count(pkg_msr);
+	pin = run_core * share_count;
+	bzero(&sum, sizeof(sum));
+	bzero(&sumsq, sizeof(sumsq));
+	edges = 0;
+	for (n = 0;;) {
+		if (run_once(cmd, &pin, run_core >= 0 ? 1 : 0, &d) != 0)
+			return (1);
+		n++;
+		edges += d.edges;
+		sum.t += d.t;
+		sum.pkg += d.pkg;
+		sum.core += d.core;
+		sumsq.t += d.t * d.t;
+		sumsq.pkg += d.pkg * d.pkg;
+		sumsq.core += d.core * d.core;
+		if (sum.t < RUN_MIN_TIME || res > sum.pkg * RUN_PRECISION)
+			continue;
+		if (run_core >= 0 && core_msr != 0 &&
+		    res > sum.core * RUN_PRECISION)
+			continue;
+		break;
+	}
+	printf("%u runs x %u iterations\n", n, run_iters);
+	print_bracket(edges, n);
+	print_stat("time", sum.t, sumsq.t, n, "s");
+	print_stat("pkg", sum.pkg, sumsq.pkg, n, "J");
+	if (run_core >= 0 && core_msr != 0) {
+		snprintf(name, sizeof(name), "core %d", run_core);
+		print_stat(name, sum.core, sumsq.core, n, "J");
+	}
+	return (0);
+}
+
+static u_int
+parse_list(char *list, u_int *vals, u_int max)
+{
+	char *tok;
+	u_int n;
+
+	n = 0;
+	while ((tok = strsep(&list, ",")) != NULL && n < max) {
+		if (*tok != '\0')
+			vals[n++] = atoi(tok);
+	}
+	return (n);
+}
+
+static bool
+freq_write(u_int cpuid, u_int khz)
+{
+#ifdef __FreeBSD__
+	int freq;
+
+	(void)cpuid;
+	freq = khz / 1000;
+	if (sysctlbyname("dev.cpu.0.freq", NULL, NULL, &freq,
+	    sizeof(freq)) != 0) {
+		perror("dev.cpu.0.freq");
+		return (false);
+	}
+#else
+	char path[MAXPATHLEN];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/"
+	    "cpufreq/scaling_max_freq", cpuid);
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		return (false);
+	}
+	fprintf(f, "%u\n", khz);
+	if (fclose(f) != 0) {
+		perror(path);
+		return (false);
+	}
+#endif
+	return (true);
+}
+
+static void
+freq_restore(void)
+{
+	u_int i;
+
+	if (!freq_capped)
+		return;
+	freq_capped = false;
+#ifdef __FreeBSD__
+	(void)i;
+	freq_write(0, freq_orig * 1000);
+#else
+	for (i = 0; i < cpu_count * share_count; i++)
+		freq_write(i, freq_orig[i]);
+#endif
+}
+
+static void
+freq_save(void)
+{
+#ifdef __FreeBSD__
+	size_t len;
+
+	len = sizeof(freq_orig);
+	if (sysctlbyname("dev.cpu.0.freq", &freq_orig, &len, NULL, 0) != 0) {
+		perror("dev.cpu.0.freq");
+		exit(1);
+	}
+#else
+	char path[MAXPATHLEN];
+	FILE *f;
+	u_int i;
+
+	freq_orig = calloc(cpu_count * share_count, sizeof(*freq_orig));
+	if (freq_orig == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < cpu_count * share_count; i++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/"
+		    "cpufreq/scaling_max_freq", i);
+		f = fopen(path, "r");
+		if (f == NULL || fscanf(f, "%u", &freq_orig[i]) != 1) {
+			perror(path);
+			exit(1);
+		}
+		fclose(f);
+	}
+#endif
+	atexit(freq_restore);
+}
+
+/* Cap all cpus at mhz; 0 restores the caps found at startup. */
+static void
+set_freq_cap(u_int mhz)
+{
+	static bool saved;
+	u_int i;
+
+	if (mhz == 0) {
+		freq_restore();
+		return;
+	}
+	if (!saved) {
+		freq_save();
+		saved = true;
+	}
+	freq_capped = true;
+#ifdef __FreeBSD__
+	(void)i;
+	if (!freq_write(0, mhz * 1000))
+		exit(1);
+#else
+	for (i = 0; i < cpu_count * share_count; i++)
+		if (!freq_write(i, mhz * 1000))
+			exit(1);
+#endif
+}
+
+/* expand a sysfs cpu list ("0-3,8") into cpus, returning the count */
+static u_int
+parse_cpulist(const char *path, u_int *cpus, u_int max)
+{
+	char buf[1024], *p;
+	u_int hi, lo, n;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return (0);
+	p = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	n = 0;
+	while (p != NULL && isdigit((unsigned char)*p)) {
+		lo = hi = strtoul(p, &p, 10);
+		if (*p == '-')
+			hi = strtoul(p + 1, &p, 10);
+		for (; lo <= hi && n < max; lo++)
+			cpus[n++] = lo;
+		if (*p != ',')
+			break;
+		p++;
+	}
+	return (n);
+}
+
+static int
+topo_cmp_compact(const void *a, const void *b)
+{
+	const struct topo *x = a, *y = b;
+
+	if (x->l3 != y->l3)
+		return (x->l3 < y->l3 ? -1 : 1);
+	if (x->smt != y->smt)
+		return (x->smt < y->smt ? -1 : 1);
+	return (x->rank < y->rank ? -1 : x->rank > y->rank);
+}
+
+static int
+topo_cmp_spread(const void *a, const void *b)
+{
+	const struct topo *x = a, *y = b;
+
+	if (x->smt != y->smt)
+		return (x->smt < y->smt ? -1 : 1);
+	if (x->rank != y->rank)
+		return (x->rank < y->rank ? -1 : 1);
+	return (x->l3 < y->l3 ? -1 : x->l3 > y->l3);
+}
+
+/*
+ * Compact fills one L3 at a time, a thread per physical core before
+ * any SMT siblings.  Spread deals threads round robin across the L3s,
+ * also physical cores first.
+ */
+static void
+topo_init(void)
+{
+	char path[MAXPATHLEN];
+	struct topo *t;
+	u_int *list, i, j, n, total;
+	FILE *f;
+
+	total = cpu_count * share_count;
+	t = calloc(total, sizeof(*t));
+	list = calloc(total, sizeof(*list));
+	if (t == NULL || list == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < total; i++) {
+		t[i].cpu = i;
+		snprintf(path, sizeof(path),
+		    "%s/cpu%u/topology/thread_siblings_list", sysfs_cpu, i);
+		n = parse_cpulist(path, list, total);
+		if (n == 0)
+			goto fail;
+		t[i].core = list[0];
+		for (j = 0; j < n && list[j] != i; j++)
+			;
+		t[i].smt = j;
+		snprintf(path, sizeof(path), "%s/cpu%u/cache/index3/id",
+		    sysfs_cpu, i);
+		f = fopen(path, "r");
+		if (f != NULL) {
+			if (fscanf(f, "%u", &t[i].l3) != 1)
+				t[i].l3 = 0;
+			fclose(f);
+		} else {
+			snprintf(path, sizeof(path),
+			    "%s/cpu%u/cache/index3/shared_cpu_list",
+			    sysfs_cpu, i);
+			/* no L3 information: one domain */
+			t[i].l3 = parse_cpulist(path, list, total) != 0 ?
+			    list[0] : 0;
+		}
+	}
+	for (i = 0; i < total; i++) {
+		for (j = 0; j < total; j++)
+			if (t[j].l3 == t[i].l3 && t[j].smt == 0 &&
+			    t[j].core < t[i].core)
+				t[i].rank++;
+	}
+	topo_compact = calloc(total, sizeof(*topo_compact));
+	topo_spread = calloc(total, sizeof(*topo_spread));
+	topo_l3 = calloc(total, sizeof(*topo_l3));
+	if (topo_compact == NULL || topo_spread == NULL || topo_l3 == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < total; i++)
+		topo_l3[i] = t[i].l3;
+	qsort(t, total, sizeof(*t), topo_cmp_compact);
+	for (i = 0; i < total; i++)
+		topo_compact[i] = t[i].cpu;
+	qsort(t, total, sizeof(*t), topo_cmp_spread);
+	for (i = 0; i < total; i++)
+		topo_spread[i] = t[i].cpu;
+fail:
+	free(list);
+	free(t);
+}
+
+static u_int
+tune_cpus(const struct tune_point *p, u_int *cpus)
+{
+	u_int i;
+
+	for (i = 0; i < p->threads; i++) {
+		if (topo_compact == NULL)
+			cpus[i] = i;
+		else
+			cpus[i] = p->spread ? topo_spread[i] : topo_compact[i];
+	}
+	return (p->threads);
+}
+
+static bool
+tune_dominates(const struct tune_point *a, const struct tune_point *b,
+    double margin)
+{
+	return (a->t * (1.0 + margin) <= b->t &&
+	    a->pkg * (1.0 + margin) <= b->pkg &&
+	    (a->t < b->t || a->pkg < b->pkg));
+}
+
+static int
+tune_cmd(char **cmd)
+{
+	struct tune_point *p, *points, *q;
+	struct sample d;
+	u_int *cpus, freqs[TUNE_MAX], threads[TUNE_MAX];
+	u_int edges, f, i, j, nfreqs, npoints, nruns, nthreads, spread, total;
+	char env[16];
+	bool pareto;
+
+	total = cpu_count * share_count;
+	nthreads = 0;
+	if (tune_threads != NULL) {
+		nthreads = parse_list(tune_threads, threads, TUNE_MAX);
+	} else {
+		for (i = 1; i < total && nthreads < TUNE_MAX - 1; i *= 2)
+			threads[nthreads++] = i;
+		threads[nthreads++] = total;
+	}
+	nfreqs = 0;
+	if (tune_freqs != NULL)
+		nfreqs = parse_list(tune_freqs, freqs, TUNE_MAX);
+	if (nfreqs == 0)
+		freqs[nfreqs++] = 0;
+
+#ifdef __linux__
+	topo_init();
+#endif
+	if (topo_compact == NULL)
+		fprintf(stderr, "cpu topology unknown, not trying spread\n");
+
+	/* stop between runs so the caps are always put back */
+	signal(SIGINT, sig_done);
+	signal(SIGTERM, sig_done);
+	points = calloc(nthreads * nfreqs * 2, sizeof(*points));
+	cpus = calloc(total, sizeof(*cpus));
+	if (points == NULL || cpus == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	npoints = 0;
+	for (i = 0; i < nthreads; i++) {
+		if (threads[i] == 0 || threads[i] > total) {
+			fprintf(stderr, "bad thread count %u\n", threads[i]);
+			exit(1);
+		}
+		for (f = 0; f < nfreqs; f++) {
+			for (spread = 0; spread < 2; spread++) {
+				if (spread && (threads[i] == 1 ||
+				    threads[i] == total || topo_compact == NULL))
+					continue;
+				p = &points[npoints++];
+				p->threads = threads[i];
+				p->spread = spread;
+				p->mhz = freqs[f];
+			}
+		}
+	}
+
+	edges = nruns = 0;
+	for (i = 0; i < npoints; i++) {
+		p = &points[i];
+		set_freq_cap(p->mhz);
+		snprintf(env, sizeof(env), "%u", p->threads);
+		setenv("OMP_NUM_THREADS", env, 1);
+		setenv("PMON_THREADS", env, 1);
+		while (p->runs < TUNE_RUNS && !p->pruned) {
+			if (run_once(cmd, cpus, tune_cpus(p, cpus), &d) != 0 ||
+			    done) {
+				freq_restore();
+				return (1);
+			}
+			p->t = (p->t * p->runs + d.t) / (p->runs + 1);
+			p->pkg = (p->pkg * p->runs + d.pkg) / (p->runs + 1);
+			p->runs++;
+			edges += d.edges;
+			nruns++;
+			for (j = 0; j < i; j++) {
+				q = &points[j];
+				if (!q->pruned &&
+				    tune_dominates(q, p, TUNE_MARGIN))
+					p->pruned = true;
+			}
+		}
+		if (verbose)
+			printf("%u threads %s cap %u MHz: %.3lf s %.2lf J%s\n",
+			    p->threads, p->spread ? "spread" : "compact",
+			    p->mhz, p->t, p->pkg, p->pruned ? " (pruned)" : "");
+	}
+	freq_restore();
+
+	print_bracket(edges, nruns);
+	printf("threads  placement      MHz   time(s)   energy(J)\n");
+	for (i = 0; i < npoints; i++) {
+		p = &points[i];
+		if (p->pruned)
+			continue;
+		pareto = true;
+		for (j = 0; j < npoints && pareto; j++) {
+			q = &points[j];
+			if (j != i && !q->pruned && tune_dominates(q, p, 0.0))
+				pareto = false;
+		}
+		if (!pareto)
+			continue;
+		printf("%7u  %-9s  ", p->threads,
+		    p->spread ? "spread" : "compact");
+		if (p->mhz != 0)
+			printf("%7u", p->mhz);
+		else
+			printf("%7s", "max");
+		printf("  %8.3lf  %10.2lf\n", p->t, p->pkg);
+	}
+	free(cpus);
+	free(points);
+	return (0);
+}
+
+static const char	*cfg_file;
+static int		cfg_line;
+static char		*cfg_p;
+static u_int		cfg_depth, cfg_maxdepth;
+static u_int		cfg_ncores;	/* cores the groups may name */
+static bool		cfg_percore;	/* per-core power available */
+static bool		cfg_dram;	/* dram power available */
+
+static void
+cfg_error(const char *msg, const char *arg)
+{
+	fprintf(stderr, "%s:%d: %s%s\n", cfg_file, cfg_line, msg, arg);
+	exit(1);
+}
+
+static void
+cfg_skip(void)
+{
+	while (isspace((unsigned char)*cfg_p))
+		cfg_p++;
+}
+
+static void
+cfg_expect(char c)
+{
+	char want[2] = { c, '\0' };
+
+	cfg_skip();
+	if (*cfg_p != c)
+		cfg_error("expected ", want);
+	cfg_p++;
+}
+
+static char *
+cfg_ident(void)
+{
+	char *name, *start;
+	size_t len;
+
+	cfg_skip();
+	start = cfg_p;
+	if (!isalpha((unsigned char)*cfg_p) && *cfg_p != '_')
+		cfg_error("expected name at ", start);
+	while (isalnum((unsigned char)*cfg_p) || *cfg_p == '_')
+		cfg_p++;
+	len = cfg_p - start;
+	name = malloc(len + 1);
+	if (name == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(name, start, len);
+	name[len] = '\0';
+	return (name);
+}
+
+static int
+group_find(const char *name)
+{
+	u_int i;
+
+	for (i = 0; i < ngroups; i++)
+		if (strcmp(groups[i].name, name) == 0)
+			return (i);
+	return (-1);
+}
+
+static int
+metric_find(const char *name)
+{
+	u_int i;
+
+	for (i = 0; i < nmetrics; i++)
+		if (strcmp(metrics[i].name, name) == 0)
+			return (i);
+	return (-1);
+}
+
+static void
+mop_emit(enum mop_type type, u_int arg, double val)
+{
+	if (type <= MOP_METRIC)
+		cfg_depth++;
+	else if (type != MOP_NEG)
+		cfg_depth--;
+	cfg_maxdepth = MAX(cfg_maxdepth, cfg_depth);
+	if (cfg_maxdepth > METRIC_STACK)
+		cfg_error("expression too deep", "");
+	mops = realloc(mops, (nmops + 1) * sizeof(*mops));
+	if (mops == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	mops[nmops].type = type;
+	mops[nmops].arg = arg;
+	mops[nmops].val = val;
+	nmops++;
+}
+
+static u_int
+group_new(const char *name)
+{
+	if (group_find(name) != -1 || metric_find(name) != -1)
+		cfg_error("duplicate name ", name);
+	groups = realloc(groups, (ngroups + 1) * sizeof(*groups));
+	if (groups == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	groups[ngroups].name = strdup(name);
+	groups[ngroups].first = ngroup_cores;
+	groups[ngroups].ncores = 0;
+	groups[ngroups].watts = 0.0;
+	return (ngroups++);
+}
+
+static void
+group_add_core(u_int g, u_int core, u_int ncores)
+{
+	if (core >= ncores)
+		cfg_error("no such core in ", groups[g].name);
+	group_cores = realloc(group_cores,
+	    (ngroup_cores + 1) * sizeof(*group_cores));
+	if (group_cores == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	group_cores[ngroup_cores++] = core;
+	groups[g].ncores++;
+}
+
+/* "cores" is every core, created the first time it is referenced */
+static int
+group_lookup(const char *name)
+{
+	int g;
+	u_int core;
+
+	g = group_find(name);
+	if (g == -1 && strcmp(name, "cores") == 0) {
+		g = group_new(name);
+		for (core = 0; core < cfg_ncores; core++)
+			group_add_core(g, core, cfg_ncores);
+	}
+	if (g != -1 && !cfg_percore)
+		cfg_error("per-core power not available for ", name);
+	return (g);
+}
+
+static void cfg_expr(void);
+
+static void
+cfg_factor(void)
+{
+	char *name;
+	int i;
+
+	cfg_skip();
+	if (*cfg_p == '(') {
+		cfg_p++;
+		cfg_expr();
+		cfg_expect(')');
+	} else if (*cfg_p == '-') {
+		cfg_p++;
+		cfg_factor();
+		mop_emit(MOP_NEG, 0, 0.0);
+	} else if (isdigit((unsigned char)*cfg_p) || *cfg_p == '.') {
+		mop_emit(MOP_CONST, 0, strtod(cfg_p, &cfg_p));
+	} else {
+		name = cfg_ident();
+		if (strcmp(name, "sum") == 0) {
+			free(name);
+			cfg_expect('(');
+			name = cfg_ident();
+			if ((i = group_lookup(name)) == -1)
+				cfg_error("unknown core group ", name);
+			mop_emit(MOP_GROUP, i, 0.0);
+			cfg_expect(')');
+		} else if (strcmp(name, "pkg") == 0) {
+			mop_emit(MOP_PKG, 0, 0.0);
+		} else if (strcmp(name, "dram") == 0) {
+			if (!cfg_dram)
+				cfg_error("dram power not available", "");
+			mop_emit(MOP_DRAM, 0, 0.0);
+		} else if ((i = group_lookup(name)) != -1) {
+			mop_emit(MOP_GROUP, i, 0.0);
+		} else if ((i = metric_find(name)) != -1) {
+			mop_emit(MOP_METRIC, i, 0.0);
+		} else {
+			cfg_error("unknown name ", name);
+		}
+		free(name);
+	}
+}
+
+static void
+cfg_term(void)
+{
+	char op;
+
+	cfg_factor();
+	for (;;) {
+		cfg_skip();
+		op = *cfg_p;
+		if (op != '*' && op != '/')
+			return;
+		cfg_p++;
+		cfg_factor();
+		mop_emit(op == '*' ? MOP_MUL : MOP_DIV, 0, 0.0);
+	}
+}
+
+static void
+cfg_expr(void)
+{
+	char op;
+
+	cfg_term();
+	for (;;) {
+		cfg_skip();
+		op = *cfg_p;
+		if (op != '+' && op != '-')
+			return;
+		cfg_p++;
+		cfg_term();
+		mop_emit(op == '+' ? MOP_ADD : MOP_SUB, 0, 0.0);
+	}
+}
+
+/* "0-7,12,16-31" */
+static void
+cfg_group(const char *name)
+{
+	u_int g, hi, lo;
+
+	g = group_new(name);
+	while (*cfg_p != '\0') {
+		if (!isdigit((unsigned char)*cfg_p))
+			cfg_error("bad core list at ", cfg_p);
+		lo = hi = strtoul(cfg_p, &cfg_p, 10);
+		cfg_skip();
+		if (*cfg_p == '-') {
+			cfg_p++;
+			cfg_skip();
+			if (!isdigit((unsigned char)*cfg_p))
+				cfg_error("bad core list at ", cfg_p);
+			hi = strtoul(cfg_p, &cfg_p, 10);
+		}
+		if (hi < lo)
+			cfg_error("bad core range in ", name);
+		for (; lo <= hi; lo++)
+			group_add_core(g, lo, cfg_ncores);
+		cfg_skip();
+		if (*cfg_p == ',')
+			cfg_p++;
+		cfg_skip();
+	}
+	if (groups[g].ncores == 0)
+		cfg_error("empty core group ", name);
+	if (!cfg_percore)
+		cfg_error("per-core power not available for ", name);
+}
+
+/*
+ * ncores, percore and dram describe the data the metrics will be run
+ * over: this machine's counters, or those of a recording.
+ */
+static void
+metrics_load(const char *file, u_int ncores, bool percore, bool dram)
+{
+	char line[1024], *name, *hash;
+	struct metric *m;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (f == NULL) {
+		perror(file);
+		exit(1);
+	}
+	cfg_file = file;
+	cfg_line = 0;
+	cfg_ncores = ncores;
+	cfg_percore = percore;
+	cfg_dram = dram;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		cfg_line++;
+		line[strcspn(line, "\n")] = '\0';
+		if ((hash = strchr(line, '#')) != NULL)
+			*hash = '\0';
+		cfg_p = line;
+		cfg_skip();
+		if (*cfg_p == '\0')
+			continue;
+		name = cfg_ident();
+		cfg_skip();
+		if (strcmp(name, "group") == 0 && *cfg_p != '=') {
+			free(name);
+			name = cfg_ident();
+			cfg_expect('=');
+			cfg_skip();
+			cfg_group(name);
+			free(name);
+			continue;
+		}
+		if (strcmp(name, "pkg") == 0 || strcmp(name, "dram") == 0 ||
+		    strcmp(name, "cores") == 0 || strcmp(name, "sum") == 0 ||
+		    strcmp(name, "group") == 0)
+			cfg_error("reserved name ", name);
+		cfg_expect('=');
+		if (group_find(name) != -1 || metric_find(name) != -1)
+			cfg_error("duplicate name ", name);
+		cfg_depth = cfg_maxdepth = 0;
+		metrics = realloc(metrics, (nmetrics + 1) * sizeof(*metrics));
+		if (metrics == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		m = &metrics[nmetrics];
+		m->name = name;
+		m->first = nmops;
+		cfg_expr();
+		cfg_skip();
+		if (*cfg_p != '\0')
+			cfg_error("trailing junk: ", cfg_p);
+		m = &metrics[nmetrics++];
+		m->nops = nmops - m->first;
+		m->value = 0.0;
+	}
+	fclose(f);
+}
+
+static void
+fft_init(u_int n)
+{
+	u_int bits, half, i, j;
+
+	fft.re = calloc(n, sizeof(double));
+	fft.im = calloc(n, sizeof(double));
+	fft.win = calloc(n, sizeof(double));
+	fft.cos = calloc(n, sizeof(double));
+	fft.sin = calloc(n, sizeof(double));
+	fft.rev = calloc(n, sizeof(u_int));
+	if (fft.re == NULL || fft.im == NULL || fft.win == NULL ||
+	    fft.cos == NULL || fft.sin == NULL || fft.rev == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (bits = 0; (1U << bits) < n; bits++)
+		;
+	fft.gain = 0.0;
+	for (i = 0; i < n; i++) {
+		fft.win[i] = 0.5 - 0.5 * cos(2 * M_PI * i / (n - 1));
+		fft.gain += fft.win[i];
+		fft.rev[i] = 0;
+		for (j = 0; j < bits; j++)
+			if (i & (1U << j))
+				fft.rev[i] |= 1U << (bits - 1 - j);
+	}
+	for (half = 1; half < n; half *= 2) {
+		for (i = 0; i < half; i++) {
+			fft.cos[half + i] = cos(M_PI * i / half);
+			fft.sin[half + i] = -sin(M_PI * i / half);
+		}
+	}
+}
+
+/*
+ * One block of a radix-2 stage: the a and b halves with twiddles w.
+ * Every access is unit stride and restrict rules out the aliasing
+ * that would otherwise need run-time checks, so the loop vectorizes
+ * (gcc -O3 -fopt-info-vec reports it).
+ */
+static void
+fft_butterfly(u_int half, double *restrict ar, double *restrict ai,
+    double *restrict br, double *restrict bi, const double *restrict wr,
+    const double *restrict wi)
+{
+	double ti, tr;
+	u_int k;
+
+	for (k = 0; k < half; k++) {
+		tr = br[k] * wr[k] - bi[k] * wi[k];
+		ti = br[k] * wi[k] + bi[k] * wr[k];
+		br[k] = ar[k] - tr;
+		bi[k] = ai[k] - ti;
+		ar[k] += tr;
+		ai[k] += ti;
+	}
+}
+
+/*
+ * In-place iterative radix-2 FFT over fft.re/fft.im.  Real and
+ * imaginary parts live in separate arrays and each stage has its own
+ * contiguous twiddle table for fft_butterfly().
+ */
+static void
+fft_run(u_int n)
+{
+	double ti, tr, *im, *re;
+	u_int half, i;
+
+	re = fft.re;
+	im = fft.im;
+	for (i = 0; i < n; i++) {
+		if (fft.rev[i] > i) {
+			tr = re[i];
+			re[i] = re[fft.rev[i]];
+			re[fft.rev[i]] = tr;
+			ti = im[i];
+			im[i] = im[fft.rev[i]];
+			im[fft.rev[i]] = ti;
+		}
+	}
+	for (half = 1; half < n; half *= 2) {
+		for (i = 0; i < n; i += 2 * half)
+			fft_butterfly(half, &re[i], &im[i], &re[i + half],
+			    &im[i + half], &fft.cos[half], &fft.sin[half]);
+	}
+}
+
+/* ring holds SPEC_WINDOW samples, the oldest at head */
+static void
+spec_analyze(const char *name, const double *ring, u_int head, double t)
+{
+	double amp[SPEC_PEAKS], a, mean, prev, next;
+	u_int bin[SPEC_PEAKS], i, k, n;
+
+	n = SPEC_WINDOW;
+	mean = 0.0;
+	for (i = 0; i < n; i++)
+		mean += ring[i];
+	mean /= n;
+	for (i = 0; i < n; i++) {
+		fft.re[i] = (ring[(head + i) % n] - mean) * fft.win[i];
+		fft.im[i] = 0.0;
+	}
+	fft_run(n);
+
+	/* convert to single-sided amplitude in watts */
+	for (k = 0; k < n / 2; k++)
+		fft.re[k] = 2.0 * hypot(fft.re[k], fft.im[k]) / fft.gain;
+	for (i = 0; i < SPEC_PEAKS; i++) {
+		amp[i] = SPEC_MIN_WATTS;
+		bin[i] = 0;
+	}
+	for (k = 2; k < n / 2 - 1; k++) {
+		a = fft.re[k];
+		prev = fft.re[k - 1];
+		next = fft.re[k + 1];
+		if (a <= prev || a < next || a <= amp[SPEC_PEAKS - 1])
+			continue;
+		for (i = SPEC_PEAKS - 1; i > 0 && amp[i - 1] < a; i--) {
+			amp[i] = amp[i - 1];
+			bin[i] = bin[i - 1];
+		}
+		amp[i] = a;
+		bin[i] = k;
+	}
+	printf("%9.2lf s  %-10s mean %6.2lf W", t, name, mean);
+	for (i = 0; i < SPEC_PEAKS && bin[i] != 0; i++)
+		printf("  %7.2lf Hz %5.2lf W", bin[i] * spec_rate / n, amp[i]);
+	printf("\n");
+}
+
+static void
+sig_marker(int sig)
+{
+	(void)sig;
+	rec_marker = 1;
+}
+
+static void
+rec_open(const char *path, double interval)
+{
+	struct timespec ts;
+
+	rec_file = fopen(path, "w");
+	if (rec_file == NULL) {
+		perror(path);
+		exit(1);
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec_hdr.magic = REC_MAGIC;
+	rec_hdr.version = REC_VERSION;
+	rec_hdr.ncores = core_msr != 0 ? cpu_count : 0;
+	rec_hdr.recsize = roundup(sizeof(struct rec) +
+	    rec_hdr.ncores * sizeof(float), sizeof(double));
+	rec_hdr.interval = interval;
+	rec_hdr.start = ts.tv_sec + ts.tv_nsec / 1000000000.0;
+	rec_buf = calloc(1, rec_hdr.recsize);
+	if (rec_buf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	if (fwrite(&rec_hdr, sizeof(rec_hdr), 1, rec_file) != 1) {
+		perror(path);
+		exit(1);
+	}
+	rec_t0 = now();
+	signal(SIGUSR1, sig_marker);
+}
+
+static void
+rec_write(void)
+{
+	u_int core;
+
+	rec_buf->t = now() - rec_t0;
+	rec_buf->pkg = pkg_watts;
+	rec_buf->dram = dram_watts;
+	rec_buf->marker = rec_marker;
+	rec_marker = 0;
+	for (core = 0; core < rec_hdr.ncores; core++)
+		rec_buf->core[core] = core_watts[core];
+	if (fwrite(rec_buf, rec_hdr.recsize, 1, rec_file) != 1 ||
+	    fflush(rec_file) != 0) {
+		perror("write");
+		exit(1);
+	}
+}
+
+/*
+ * "pmon view" scrubs through a recording in the terminal.  Each
+ * screen column covers view.span records, reduced to their min/max
+ * while drawing, so zooming out over a long capture only touches
+ * the mapped pages it needs.
+ */
+static struct {
+	const struct rec_hdr *hdr;
+	const char *map;
+	size_t nrec;
+	size_t pos;
+	size_t span;
+	u_int rows;
+	u_int cols;
+	struct termios saved;
+} view;
+
+static const char view_ramp[] = " .:-=+*#%@";
+
+static const struct rec *
+view_rec(size_t i)
+{
+	return ((const struct rec *)(const void *)(view.map +
+	    sizeof(struct rec_hdr) + i * view.hdr->recsize));
+}
+
+/* first record at or after t */
+static size_t
+view_find(double t)
+{
+	size_t hi, lo, mid;
+
+	lo = 0;
+	hi = view.nrec;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (view_rec(mid)->t < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (MIN(lo, view.nrec - 1));
+}
+
+static char
+view_shade(double v, double max)
+{
+	int i;
+
+	if (max <= 0.0 || v <= 0.0)
+		return (view_ramp[0]);
+	i = 1 + (int)(v / max * (sizeof(view_ramp) - 3));
+	return (view_ramp[MIN(i, (int)sizeof(view_ramp) - 2)]);
+}
+
+static void
+view_time(char *buf, size_t len, double t)
+{
+	struct tm tm;
+	time_t wall;
+
+	wall = view.hdr->start + t;
+	localtime_r(&wall, &tm);
+	snprintf(buf, len, "+%02d:%02d:%02d (", (int)t / 3600,
+	    (int)t / 60 % 60, (int)t % 60);
+	strftime(buf + strlen(buf), len - strlen(buf), "%F %T)", &tm);
+}
+
+static void
+view_draw(void)
+{
+	const struct rec *r;
+	char line[4096], when[64];
+	double cmax, pmax, v;
+	size_t c, end, first, i;
+	u_int core, cores_per_row, ncols, row, rows;
+
+	ncols = MIN(view.cols - 11, sizeof(line) - 1);
+	rows = view.rows > 7 ? view.rows - 7 : 1;
+	cores_per_row = view.hdr->ncores == 0 ? 1 :
+	    (view.hdr->ncores + rows - 1) / rows;
+	end = MIN(view.pos + ncols * view.span, view.nrec);
+
+	/* scale against the visible range */
+	pmax = cmax = 0.0;
+	for (i = view.pos; i < end; i++) {
+		r = view_rec(i);
+		pmax = MAX(pmax, MAX(r->pkg, r->dram));
+		for (core = 0; core < view.hdr->ncores; core++)
+			cmax = MAX(cmax, r->core[core]);
+	}
+
+	printf("\033[H\033[2J");
+	view_time(when, sizeof(when), view_rec(view.pos)->t);
+	printf("%s  %zu/%zu  %.0lf s/col  pkg max %.1lf W  core max %.1lf W"
+	    "\r\n", when, view.pos, view.nrec,
+	    view.span * view.hdr->interval, pmax, cmax);
+
+	for (row = 0; row < 4; row++) {
+		printf("%-10s ", row == 0 ? "pkg max" : row == 1 ? "pkg min" :
+		    row == 2 ? "dram" : "markers");
+		for (c = 0; c < ncols; c++) {
+			first = view.pos + c * view.span;
+			if (first >= end) {
+				line[c] = ' ';
+				continue;
+			}
+			v = row == 1 ? HUGE_VAL : 0.0;
+			for (i = first; i < MIN(first + view.span, end); i++) {
+				r = view_rec(i);
+				if (row == 0)
+					v = MAX(v, r->pkg);
+				else if (row == 1)
+					v = MIN(v, r->pkg);
+				else if (row == 2)
+					v = MAX(v, r->dram);
+				else if (r->marker)
+					v = 1.0;
+			}
+			line[c] = row == 3 ? (v != 0.0 ? '|' : ' ') :
+			    view_shade(v, pmax);
+		}
+		line[ncols] = '\0';
+		printf("%s\r\n", line);
+	}
+
+	for (row = 0; row * cores_per_row < view.hdr->ncores &&
+	    row < rows; row++) {
+		printf("core %-5u ", row * cores_per_row);
+		for (c = 0; c < ncols; c++) {
+			first = view.pos + c * view.span;
+			v = 0.0;
+			for (i = first; i < MIN(first + view.span, end); i++) {
+				r = view_rec(i);
+				for (core = row * cores_per_row;
+				    core < MIN((row + 1) * cores_per_row,
+				    view.hdr->ncores); core++)
+					v = MAX(v, r->core[core]);
+			}
+			line[c] = view_shade(v, cmax);
+		}
+		line[ncols] = '\0';
+		printf("%s\r\n", line);
+	}
+	printf("h/l scroll  H/L page  +/- zoom  n/N marker  0/$ ends  "
+	    "g goto  q quit\r\n");
+	fflush(stdout);
+}
+
+/* read a line in raw mode */
+static void
+view_prompt(const char *prompt, char *buf, size_t len)
+{
+	size_t n;
+	char ch;
+
+	printf("%s", prompt);
+	fflush(stdout);
+	n = 0;
+	while (read(STDIN_FILENO, &ch, 1) == 1 && ch != '\r' && ch != '\n') {
+		if ((ch == 0x7f || ch == '\b') && n > 0) {
+			n--;
+			printf("\b \b");
+		} else if (isprint((unsigned char)ch) && n < len - 1) {
+			buf[n++] = ch;
+			putchar(ch);
+		}
+		fflush(stdout);
+	}
+	buf[n] = '\0';
+}
+
+static void
+view_restore(void)
+{
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &view.saved);
+	printf("\033[2J\033[H");
+}
+
+static int
+view_cmd(const char *path)
+{
+	struct sigaction sa;
+	struct termios raw;
+	struct winsize ws;
+	struct stat st;
+	char buf[32], key[8];
+	size_t i, page;
+	int fd, h, m, sec;
+	ssize_t len;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) != 0) {
+		perror(path);
+		exit(1);
+	}
+	if ((size_t)st.st_size < sizeof(struct rec_hdr)) {
+		fprintf(stderr, "%s: not a pmon recording\n", path);
+		exit(1);
+	}
+	view.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (view.map == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+	view.hdr = (const void *)view.map;
+	if (view.hdr->magic != REC_MAGIC ||
+	    view.hdr->version != REC_VERSION ||
+	    view.hdr->recsize < sizeof(struct rec) +
+	    view.hdr->ncores * sizeof(float)) {
+		fprintf(stderr, "%s: not a pmon recording\n", path);
+		exit(1);
+	}
+	view.nrec = (st.st_size - sizeof(struct rec_hdr)) / view.hdr->recsize;
+	if (view.nrec == 0) {
+		fprintf(stderr, "%s: empty recording\n", path);
+		exit(1);
+	}
+	view.span = 1;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_col < 20) {
+		ws.ws_col = 80;
+		ws.ws_row = 24;
+	}
+	view.cols = ws.ws_col;
+	view.rows = ws.ws_row;
+	if (tcgetattr(STDIN_FILENO, &view.saved) != 0) {
+		perror("tcgetattr");
+		exit(1);
+	}
+	/*
+	 * ^C arrives as a key; other signals interrupt read() (no
+	 * SA_RESTART) so the terminal is always restored.
+	 */
+	bzero(&sa, sizeof(sa));
+	sa.sa_handler = sig_done;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	raw = view.saved;
+	raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+	raw.c_oflag &= ~OPOST;
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+	while (!done) {
+		view_draw();
+		page = (view.cols - 11) * view.span;
+		len = read(STDIN_FILENO, key, sizeof(key));
+		if (len <= 0)
+			break;
+		/* arrow keys */
+		if (len == 3 && key[0] == '\033' && key[1] == '[')
+			key[0] = key[2] == 'D' ? 'h' : key[2] == 'C' ? 'l' :
+			    key[2] == 'A' ? '+' : key[2] == 'B' ? '-' : 0;
+		switch (key[0]) {
+		case 'q':
+		case '\003':	/* ^C */
+		case '\034':	/* ^\ */
+			view_restore();
+			return (0);
+		case 'h':
+			view.pos -= MIN(view.pos, page / 4);
+			break;
+		case 'l':
+			view.pos = MIN(view.pos + page / 4, view.nrec - 1);
+			break;
+		case 'H':
+			view.pos -= MIN(view.pos, page);
+			break;
+		case 'L':
+			view.pos = MIN(view.pos + page, view.nrec - 1);
+			break;
+		case '+':
+			view.span = MAX(view.span / 2, 1);
+			break;
+		case '-':
+			view.span = MIN(view.span * 2, view.nrec);
+			break;
+		case '0':
+			view.pos = 0;
+			break;
+		case '$':
+			view.pos = view.nrec - MIN(view.nrec, page);
+			break;
+		case 'n':
+			for (i = view.pos + 1; i < view.nrec; i++)
+				if (view_rec(i)->marker)
+					break;
+			if (i < view.nrec)
+				view.pos = i;
+			break;
+		case 'N':
+			for (i = view.pos; i > 0; i--)
+				if (view_rec(i - 1)->marker)
+					break;
+			if (i > 0)
+				view.pos = i - 1;
+			break;
+		case 'g':
+			view_prompt("goto [+hh:mm:ss | seconds]: ", buf,
+			    sizeof(buf));
+			if (sscanf(buf, "+%d:%d:%d", &h, &m, &sec) == 3)
+				view.pos = view_find(h * 3600 + m * 60 + sec);
+			else if (buf[0] != '\0')
+				view.pos = view_find(atof(buf));
+			break;
+		}
+	}
+	view_restore();
+	return (0);
+}
+
+/* black -> red -> yellow -> white */
+static void
+heat_color(double v, unsigned char *rgb)
+{
+	double x;
+
+	if (heat_log)
+		v = log1p(v) / log1p(heat_max);
+	else
+		v = v / heat_max;
+	x = MIN(MAX(v, 0.0), 1.0) * 3.0;
+	rgb[0] = 255 * MIN(x, 1.0);
+	rgb[1] = 255 * MIN(MAX(x - 1.0, 0.0), 1.0);
+	rgb[2] = 255 * MIN(MAX(x - 2.0, 0.0), 1.0);
+}
+
+static int
+heatmap_cmd(const char *path, const char *out)
+{
+	struct rec_hdr hdr;
+	struct stat st;
+	const struct rec *r;
+	float *cmax, *cmin;
+	unsigned char *img;
+	char *buf;
+	size_t col, got, i, nrec, rec, width;
+	u_int core, y;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL || fstat(fileno(f), &st) != 0) {
+		perror(path);
+		exit(1);
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != REC_MAGIC ||
+	    hdr.version != REC_VERSION || hdr.ncores == 0 ||
+	    hdr.recsize < sizeof(struct rec) + hdr.ncores * sizeof(float)) {
+		fprintf(stderr, "%s: not a pmon recording with core data\n",
+		    path);
+		exit(1);
+	}
+	nrec = (st.st_size - sizeof(hdr)) / hdr.recsize;
+	if (nrec == 0) {
+		fprintf(stderr, "%s: empty recording\n", path);
+		exit(1);
+	}
+	width = MIN(heat_width, nrec);
+	cmax = calloc(width * hdr.ncores, sizeof(*cmax));
+	cmin = calloc(width * hdr.ncores, sizeof(*cmin));
+	buf = malloc((size_t)HEAT_CHUNK * hdr.recsize);
+	if (cmax == NULL || cmin == NULL || buf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < width * hdr.ncores; i++)
+		cmin[i] = HUGE_VALF;
+
+	/* column col covers records [col * nrec / width, ...) */
+	rec = 0;
+	while (rec < nrec &&
+	    (got = fread(buf, hdr.recsize, HEAT_CHUNK, f)) > 0) {
+		for (i = 0; i < got && rec < nrec; i++, rec++) {
+			r = (const struct rec *)(const void *)
+			    (buf + i * hdr.recsize);
+			col = rec * width / nrec;
+			for (core = 0; core < hdr.ncores; core++) {
+				cmax[col * hdr.ncores + core] = MAX(
+				    cmax[col * hdr.ncores + core],
+				    r->core[core]);
+				cmin[col * hdr.ncores + core] = MIN(
+				    cmin[col * hdr.ncores + core],
+				    r->core[core]);
+			}
+		}
+	}
+	fclose(f);
+	free(buf);
+
+	if (heat_max <= 0.0) {
+		for (i = 0; i < width * hdr.ncores; i++)
+			heat_max = MAX(heat_max, cmax[i]);
+		if (heat_max <= 0.0)
+			heat_max = 1.0;
+	}
+
+	/* two pixel rows per core, in core (topology) order */
+	img = malloc(width * hdr.ncores * 2 * 3);
+	if (img == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (core = 0; core < hdr.ncores; core++) {
+		y = core * 2;
+		for (col = 0; col < width; col++) {
+			heat_color(cmax[col * hdr.ncores + core],
+			    &img[(y * width + col) * 3]);
+			heat_color(cmin[col * hdr.ncores + core],
+			    &img[((y + 1) * width + col) * 3]);
+		}
+	}
+	f = strcmp(out, "-") == 0 ? stdout : fopen(out, "w");
+	if (f == NULL) {
+		perror(out);
+		exit(1);
+	}
+	fprintf(f, "P6\n%zu %u\n255\n", width, hdr.ncores * 2);
+	if (fwrite(img, 3, width * hdr.ncores * 2, f) !=
+	    width * hdr.ncores * 2 || fflush(f) != 0) {
+		perror(out);
+		exit(1);
+	}
+	if (f != stdout)
+		fclose(f);
+	if (verbose)
+		fprintf(stderr, "%zu records, %zu per column, %.2lf W max\n",
+		    nrec, (nrec + width - 1) / width, heat_max);
+	free(img);
+	free(cmin);
+	free(cmax);
+	return (0);
+}
+
+/*
+ * One core group per L3 for live spectrum, from the sysfs topology.
+ * They are named "l3.<id>", which cannot clash with a -c group name.
+ */
+static void
+spec_l3_groups(void)
+{
+	char name[32];
+	u_int core, g, i, l3;
+
+	if (topo_l3 == NULL || core_msr == 0)
+		return;
+	for (core = 0; core < cpu_count; core++) {
+		l3 = topo_l3[core * share_count];
+		snprintf(name, sizeof(name), "l3.%u", l3);
+		if (group_find(name) != -1)
+			continue;
+		g = group_new(name);
+		for (i = core; i < cpu_count; i++)
+			if (topo_l3[i * share_count] == l3)
+				group_add_core(g, i, cpu_count);
+	}
+}
+
+/*
+ * Open a saved log for spectrum.  A -w recording (which starts with
+ * the "PMRC" magic) supplies its own rate and per-core data, so core
+ * groups from -c are compiled against the recording's cores.
+ */
+static FILE *
+spectrum_open(const char *file, const char *config, struct rec **recp)
+{
+	struct rec_hdr hdr;
+	FILE *f;
+	int ch;
+
+	*recp = NULL;
+	f = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+	if (f == NULL) {
+		perror(file);
+		exit(1);
+	}
+	ch = getc(f);
+	if (ch != EOF)
+		ungetc(ch, f);
+	if (ch != (REC_MAGIC & 0xff)) {
+		/* a text log carries neither its rate nor per-core data */
+		if (spec_rate == 0.0) {
+			fprintf(stderr, "%s: text log, give its sample rate "
+			    "with -S\n", file);
+			exit(1);
+		}
+		if (config != NULL) {
+			fprintf(stderr, "%s: text log has no per-core data "
+			    "for -c\n", file);
+			exit(1);
+		}
+		return (f);
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != REC_MAGIC ||
+	    hdr.version != REC_VERSION || hdr.interval <= 0.0 ||
+	    hdr.recsize < sizeof(struct rec) + hdr.ncores * sizeof(float)) {
+		fprintf(stderr, "%s: not a pmon recording\n", file);
+		exit(1);
+	}
+	spec_rate = 1.0 / hdr.interval;
+	*recp = malloc(hdr.recsize);
+	if (*recp == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	rec_hdr = hdr;
+	if (config != NULL)
+		metrics_load(config, hdr.ncores, hdr.ncores != 0, true);
+	return (f);
+}
+
+static int
+spectrum_cmd(const char *file, const char *config)
+{
+	struct timespec next;
+	struct rec *r;
+	double *last, *ring, *series, e, pkg, t, t0, tlast, v;
+	char line[1024], *end;
+	uint64_t count;
+	long period;
+	u_int core, g, i, n, nseries;
+	FILE *f;
+
+	n = SPEC_WINDOW;
+	pkg = 0.0;
+	f = NULL;
+	r = NULL;
+	if (file != NULL)
+		f = spectrum_open(file, config, &r);
+	else if (spec_rate == 0.0)
+		spec_rate = SPEC_RATE;
+	period = 1000000000.0 / spec_rate;
+	nseries = file == NULL || r != NULL ? 1 + ngroups : 1;
+	fft_init(n);
+	ring = calloc(n * nseries, sizeof(*ring));
+	series = calloc(nseries, sizeof(*series));
+	last = calloc(cpu_count + 1, sizeof(*last));
+	if (ring == NULL || series == NULL || last == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	if (file == NULL) {
+		pkg = read_joules(&softc[cpu_count], pkg_msr);
+		for (core = 0; ngroups != 0 && core < cpu_count; core++)
+			last[core] = read_joules(&softc[core], core_msr);
+		signal(SIGINT, sig_done);
+		signal(SIGTERM, sig_done);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	t0 = tlast = now();
+	for (count = 0; !done;) {
+		if (r != NULL) {
+			if (fread(r, rec_hdr.recsize, 1, f) != 1)
+				break;
+			series[0] = r->pkg;
+			for (g = 0; g < ngroups; g++) {
+				for (i = 0; i < groups[g].ncores; i++)
+					series[g + 1] += r->core[
+					    group_cores[groups[g].first + i]];
+			}
+			t = r->t;
+		} else if (f != NULL) {
+			if (fgets(line, sizeof(line), f) == NULL)
+				break;
+			v = strtod(line, &end);
+			if (end == line)
+				continue;
+			series[0] = v;
+			t = (double)count / spec_rate;
+		} else {
+			next.tv_nsec += period;
+			while (next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+			    NULL);
+			t = now();
+			e = read_joules(&softc[cpu_count], pkg_msr);
+			series[0] = joules_delta(pkg, e, pkg_msr) / (t - tlast);
+			pkg = e;
+			for (core = 0; ngroups != 0 && core < cpu_count; core++) {
+				e = read_joules(&softc[core], core_msr);
+				core_watts[core] =
+				    joules_delta(last[core], e, core_msr) /
+				    (t - tlast);
+				last[core] = e;
+			}
+			for (g = 0; g < ngroups; g++) {
+				for (i = 0; i < groups[g].ncores; i++)
+					series[g + 1] += core_watts[
+					    group_cores[groups[g].first + i]];
+			}
+			tlast = t;
+			t -= t0;
+		}
+		for (i = 0; i < nseries; i++) {
+			ring[i * n + count % n] = series[i];
+			series[i] = 0.0;
+		}
+		count++;
+		if (count < n || count % (n / 2) != 0)
+			continue;
+		for (i = 0; i < nseries; i++)
+			spec_analyze(i == 0 ? "pkg" : groups[i - 1].name,
+			    &ring[i * n], count % n, t);
+		fflush(stdout);
+	}
+	if (f != NULL && f != stdin)
+		fclose(f);
+	free(r);
+	free(last);
+	free(series);
+	free(ring);
+	return (0);
+}
+
+static FILE *
+cgroup_open(struct budget *b, const char *file, const char *mode)
+{
+	char path[MAXPATHLEN];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", b->path, file);
+	f = fopen(path, mode);
+	if (f == NULL)
+		perror(path);
+	return (f);
+}
+
+/*
+ * A cgroup that has been removed since startup is dropped from the
+ * budget list rather than ending pmon, which would leave the others
+ * throttled.
+ */
+static bool
+cgroup_usage(struct budget *b, uint64_t *usage)
+{
+	char line[128];
+	uintmax_t val;
+	FILE *f;
+
+	f = cgroup_open(b, "cpu.stat", "r");
+	if (f == NULL) {
+		b->gone = true;
+		return (false);
+	}
+	val = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "usage_usec %ju", &val) == 1)
+			break;
+	}
+	fclose(f);
+	*usage = val;
+	return (true);
+}
+
+static void
+cgroup_read_max(struct budget *b, double full)
+{
+	char quota[32] = "max";
+	FILE *f;
+
+	f = cgroup_open(b, "cpu.max", "r");
+	if (f == NULL)
+		exit(1);
+	if (fgets(b->orig, sizeof(b->orig), f) == NULL ||
+	    sscanf(b->orig, "%31s %u", quota, &b->period) != 2) {
+		b->period = BUDGET_PERIOD;
+		snprintf(b->orig, sizeof(b->orig), "max %u\n", b->period);
+	}
+	fclose(f);
+	if (strcmp(quota, "max") == 0)
+		b->quota = b->period * full;
+	else
+		b->quota = MIN(atof(quota), b->period * full);
+	b->orig_quota = b->quota;
+}
+
+/*
+ * restore writes back the cpu.max line found at startup.  Failures
+ * are reported but never fatal: this also runs from atexit.
+ */
+static void
+cgroup_write_max(struct budget *b, bool restore)
+{
+	FILE *f;
+
+	f = cgroup_open(b, "cpu.max", "w");
+	if (f == NULL) {
+		b->gone = true;
+		return;
+	}
+	if (restore)
+		fputs(b->orig, f);
+	else
+		fprintf(f, "%.0lf %u\n", b->quota, b->period);
+	if (fclose(f) != 0)
+		perror("cpu.max");
+}
+
+static void
+budget_add(char *arg)
+{
+	struct budget *b;
+	char *sep;
+
+	sep = strrchr(arg, ':');
+	if (sep == NULL || atof(sep + 1) <= 0.0) {
+		fprintf(stderr, "bad budget %s, want cgroup:watts\n", arg);
+		exit(1);
+	}
+	budgets = realloc(budgets, (nbudgets + 1) * sizeof(*budgets));
+	if (budgets == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	b = &budgets[nbudgets++];
+	bzero(b, sizeof(*b));
+	*sep = '\0';
+	b->path = arg;
+	b->watts = atof(sep + 1);
+}
+
+/* Runs at exit, so every exit(1) path puts the quotas back too. */
+static void
+budget_restore(void)
+{
+	int i;
+
+	for (i = 0; i < nbudgets; i++) {
+		if (!budgets[i].gone)
+			cgroup_write_max(&budgets[i], true);
+	}
+}
+
+static void
+budget_init(void)
+{
+	int i;
+
+	for (i = 0; i < nbudgets; i++) {
+		cgroup_read_max(&budgets[i], cpu_count * share_count);
+		if (!cgroup_usage(&budgets[i], &budgets[i].usage))
+			exit(1);
+	}
+	if (nbudgets != 0)
+		atexit(budget_restore);
+}
+
+/*
+ * Called once per interval with the package power (or -1.0 if not
+ * yet known).  Over budget, the quota is cut toward what the cgroup
+ * would need to fit, but by no more than BUDGET_STEP per interval so
+ * tenants are slowed gradually.  Under budget, it is relaxed by the
+ * same step until it is back at the quota found at startup.
+ */
+static void
+budget_update(double pkg)
+{
+	struct budget *b;
+	uint64_t usage;
+	double full, share, target, used, watts;
+	int i;
+
+	for (i = 0; i < nbudgets; i++) {
+		b = &budgets[i];
+		if (b->gone || !cgroup_usage(b, &usage))
+			continue;
+		share = (usage - b->usage) * scale /
+		    (1000000.0 * cpu_count * share_count);
+		b->usage = usage;
+		if (pkg < 0.0)
+			continue;
+
+		full = (double)b->period * cpu_count * share_count;
+		used = share * full;
+		watts = share * pkg;
+		target = b->quota;
+		if (watts > b->watts) {
+			target = used * MAX(b->watts / watts, 1.0 - BUDGET_STEP);
+			target = MIN(target, b->quota);
+		} else if (watts < b->watts * BUDGET_HYST &&
+		    b->quota < b->orig_quota) {
+			target = b->quota * (1.0 + BUDGET_STEP);
+		}
+		target = MIN(MAX(target, BUDGET_MIN_QUOTA), b->orig_quota);
+		if (target != b->quota) {
+			b->quota = target;
+			cgroup_write_max(b, target == b->orig_quota);
+		}
+		if (verbose)
+			printf("\t%s: %4.2lf/%4.2lf W quota %.0lf/%u\n",
+			    b->path, watts, b->watts, b->quota, b->period);
+	}
+	fflush(stdout);
+}
+
+static void
+usage(char *name)
+{
+	fprintf(stderr, "usage: %s [-v] [-b cgroup:watts] [-c config] "
+	    "[-H histogram [-K keyfile] [-L slo_us]] [-M resctrl] "
+	    "[-w recording] [interval]\n", name);
+	fprintf(stderr, "       %s [-n iters] [-p core] run -- cmd [args ...]\n",
+	    name);
+	fprintf(stderr, "       %s [-v] [-t threads,...] [-f mhz,...] "
+	    "tune -- cmd [args ...]\n", name);
+	fprintf(stderr, "       %s [-c config] [-S hz] spectrum [file]\n",
+	    name);
+	fprintf(stderr, "       %s view recording\n", name);
+	fprintf(stderr, "       %s [-l] [-m watts] [-W width] heatmap "
+	    "recording out.ppm\n", name);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *config, *mode, *record, *resctrl, *progname = argv[0];
+	double watts;
+	u_int left;
+	int timeo = 1;
+	char c;
+
+	config = record = resctrl = NULL;
+
+	while ((c = getopt(argc, argv, "b:c:f:H:K:L:lM:m:n:p:S:t:vW:w:")) != -1) {
+		switch (c) {
+		case 'b':
+			budget_add(optarg);
+			break;
+		case 'c':
+			config = optarg;
+			break;
+		case 'f':
+			tune_freqs = optarg;
+			break;
+		case 'H':
+			hist_open(optarg);
+			break;
+		case 'K':
+			hist_keyfile = optarg;
+			break;
+		case 'L':
+			hist_slo = atof(optarg);
+			break;
+		case 'l':
+			heat_log = true;
+			break;
+		case 'M':
+			resctrl = optarg;
+			break;
+		case 'm':
+			heat_max = atof(optarg);
+			break;
+		case 'n':
+			run_iters = MAX(atoi(optarg), 1);
+			break;
+		case 'p':
+			run_core = atoi(optarg);
+			break;
+		case 'S':
+			spec_rate = atof(optarg);
+			if (spec_rate <= 0.0)
+				usage(progname);
+			break;
+		case 't':
+			tune_threads = optarg;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'W':
+			heat_width = atoi(optarg);
+			if (heat_width == 0)
+				usage(progname);
+			break;
+		case 'w':
+			record = optarg;
+			break;
+		default:
+			usage(progname);
 		}
 	}
 	argc -= optind;
 	argv += optind;
 
+	if (*argv != NULL && strcmp(*argv, "view") == 0) {
+		if (argv[1] == NULL)
+			usage(progname);
+		return (view_cmd(argv[1]));
+	}
+
+	if (*argv != NULL && strcmp(*argv, "heatmap") == 0) {
+		if (argv[1] == NULL || argv[2] == NULL)
+			usage(progname);
+		return (heatmap_cmd(argv[1], argv[2]));
+	}
+
+	if (*argv != NULL && strcmp(*argv, "spectrum") == 0) {
+		/* recordings can be analyzed on any machine */
+		if (argv[1] != NULL)
+			return (spectrum_cmd(argv[1], config));
+		identify_cpu();
+#ifdef __linux__
+		topo_init();
+#endif
+		spec_l3_groups();
+		if (config != NULL)
+			metrics_load(config, cpu_count, core_msr != 0,
+			    dram_msr != 0);
+		return (spectrum_cmd(NULL, NULL));
+	}
+
+	if (*argv != NULL &&
+	    (strcmp(*argv, "run") == 0 || strcmp(*argv, "tune") == 0)) {
+		mode = *argv++;
+		if (*argv != NULL && strcmp(*argv, "--") == 0)
+			argv++;
+		if (*argv == NULL)
+			usage(progname);
+		identify_cpu();
+		if (strcmp(mode, "tune") == 0)
+			return (tune_cmd(argv));
+		if (run_core >= (int)cpu_count) {
+			fprintf(stderr, "core %d out of range\n", run_core);
+			exit(1);
+		}
+		return (run_cmd(argv));
+	}
+
 	if (*argv)
 		timeo = atof(*argv);
 
 	scale = 1.0 / (double) timeo;
 	identify_cpu();
-	while (1) {
-		read_power();
-		sleep(timeo);
+	if (config != NULL)
+		metrics_load(config, cpu_count, core_msr != 0, dram_msr != 0);
+	if (resctrl != NULL)
+		mbm_init(resctrl);
+	if (record != NULL)
+		rec_open(record, timeo);
+	budget_init();
+	if (hist != NULL || nbudgets != 0) {
+		signal(SIGINT, sig_done);
+		signal(SIGTERM, sig_done);
+	}
+	while (!done) {
+		watts = read_power();
+		if (rec_file != NULL && watts >= 0.0)
+			rec_write();
+		if (nbudgets != 0)
+			budget_update(watts);
+		/* a SIGUSR1 marker must not shorten the interval */
+		for (left = timeo; left > 0 && !done;)
+			left = sleep(left);
 	}
+	if (hist != NULL)
+		hist_report();
+	return (0);
 }